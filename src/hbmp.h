@@ -58,6 +58,22 @@ typedef struct {
     uint8_t rgbt_red;
 } RGBTRIPLE;
 
+/**
+ * @struct RGBQUAD
+ * @brief  The RGBQUAD structure describes a color consisting of relative intensities of
+ *         red, green, and blue. The color table of an indexed BMP is an array of these.
+ *         Adapted from https://learn.microsoft.com/en-us/windows/win32/api/wingdi/ns-wingdi-rgbquad.
+ */
+typedef struct {
+    uint8_t rgb_blue;
+    uint8_t rgb_green;
+    uint8_t rgb_red;
+    uint8_t rgb_reserved;   /**< Reserved; must be set to 0. */
+} RGBQUAD;
+
+/** The largest color table an indexed (1, 4 or 8 bits per pixel) BMP can have. */
+#define BMP_MAX_PALETTE_SIZE 256
+
 /**
  * @brief Checks if the BMP file header and info header are compatible with the
  *        supported BMP file format.
@@ -87,6 +103,32 @@ int write_image(const BITMAPFILEHEADER * restrict bf,
                 FILE * restrict out_file, size_t height,
                 size_t width, const RGBTRIPLE image[height][width]);
 
+/**
+ * @brief Writes an indexed image to a BMP file.
+ *
+ * This function writes the image as a 1, 4 or 8 bits per pixel BMP, followed by
+ * its color table. The headers are derived from the provided ones, with
+ * bi_bitcount, bi_clr_used, bi_size_image, bf_offbits and bf_size adjusted to
+ * match.
+ *
+ * @param bf The BMP file header of the source image.
+ * @param bi The BMP info header of the source image.
+ * @param out_file The output file stream.
+ * @param height The height of the image.
+ * @param width The width of the image.
+ * @param bitcount The number of bits per pixel; one of 1, 4 or 8.
+ * @param ncolours The number of entries in the color table.
+ * @param palette The color table.
+ * @param indices The 2D array of color table indices, each less than ncolours.
+ * @return 0 on success, -1 on failure.
+ */
+int write_indexed_image(const BITMAPFILEHEADER * restrict bf,
+                        const BITMAPINFOHEADER * restrict bi,
+                        FILE * restrict out_file, size_t height,
+                        size_t width, unsigned bitcount, size_t ncolours,
+                        const RGBQUAD palette[restrict ncolours],
+                        const uint8_t indices[height][width]);
+
 /**
  * @brief Read an image from a BMP file.
  *
@@ -157,4 +199,80 @@ void reflect(size_t height, size_t width, RGBTRIPLE image[height][width]);
  */
 void blur(size_t height, size_t width, RGBTRIPLE image[height][width]);
 
+/**
+ * @brief Check whether every pixel of an image is a shade of gray.
+ *
+ * @param height The height of the image.
+ * @param width The width of the image.
+ * @param image The 2D array representing the image.
+ * @return true if red, green and blue are equal for every pixel, false otherwise.
+ */
+bool is_grayscale(size_t height, size_t width,
+                  const RGBTRIPLE image[height][width]);
+
+/**
+ * @brief Build a color table of evenly spaced shades of gray.
+ *
+ * @param ncolours The number of shades; between 2 and BMP_MAX_PALETTE_SIZE.
+ * @param palette The color table to fill.
+ * @return The number of entries written, i.e. ncolours.
+ */
+size_t make_gray_palette(size_t ncolours, RGBQUAD palette[ncolours]);
+
+/**
+ * @brief Build a color table for an image using median cut.
+ *
+ * The colors of the image are binned into a 15-bit histogram, which is then
+ * recursively split along its longest axis at the median until max_colours
+ * boxes exist or no box can be split further. Each box contributes the mean
+ * of the pixels within it to the palette.
+ *
+ * @param height The height of the image.
+ * @param width The width of the image.
+ * @param image The 2D array representing the image.
+ * @param max_colours The maximum size of the color table.
+ * @param palette The color table to fill.
+ * @return The number of entries written, or 0 on failure.
+ */
+size_t make_palette(size_t height, size_t width,
+                    const RGBTRIPLE image[height][width], size_t max_colours,
+                    RGBQUAD palette[max_colours]);
+
+/**
+ * @brief Map a grayscale image onto a gray color table.
+ *
+ * The index of each pixel is computed directly from its intensity, with no
+ * search of the color table.
+ *
+ * @param height The height of the image.
+ * @param width The width of the image.
+ * @param image The 2D array representing the image.
+ * @param ncolours The number of entries of the table built by make_gray_palette().
+ * @param dither Whether to apply ordered dithering.
+ * @param indices The 2D array to store the color table indices in.
+ */
+void map_gray(size_t height, size_t width,
+              const RGBTRIPLE image[height][width], size_t ncolours,
+              bool dither, uint8_t indices[height][width]);
+
+/**
+ * @brief Map an image onto an arbitrary color table.
+ *
+ * The nearest entry for each 15-bit color is searched for once and kept in a
+ * lookup table, so that every further pixel of that color costs a single
+ * table lookup.
+ *
+ * @param height The height of the image.
+ * @param width The width of the image.
+ * @param image The 2D array representing the image.
+ * @param ncolours The number of entries in the color table.
+ * @param palette The color table.
+ * @param dither Whether to apply ordered dithering.
+ * @param indices The 2D array to store the color table indices in.
+ */
+void map_palette(size_t height, size_t width,
+                 const RGBTRIPLE image[height][width], size_t ncolours,
+                 const RGBQUAD palette[ncolours], bool dither,
+                 uint8_t indices[height][width]);
+
 #endif                          /* HBMP_H */
@@ -15,3 +15,17 @@ bool bmp_check_header(const BITMAPFILEHEADER * restrict bf,
         && bi->bi_bitcount == SUPPORTED_BI_BIT_COUNT
         && bi->bi_compression == SUPPORTED_BI_COMPRESSION;
 }
+
+bool is_grayscale(size_t height, size_t width,
+                  const RGBTRIPLE image[height][width])
+{
+    for (size_t i = 0; i < height; ++i) {
+        for (size_t j = 0; j < width; ++j) {
+            if (image[i][j].rgbt_red != image[i][j].rgbt_green
+                || image[i][j].rgbt_green != image[i][j].rgbt_blue) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
@@ -11,8 +11,10 @@
 
 #include "hbmp.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #define BMP_SCANLINE_PADDING 4
@@ -47,10 +49,20 @@ static int write_scanlines(FILE * out_file, size_t height, size_t width,
     return 0;
 }
 
-int write_image(const BITMAPFILEHEADER * restrict bf,
-                const BITMAPINFOHEADER * restrict bi,
-                FILE * restrict out_file, size_t height,
-                size_t width, const RGBTRIPLE image[height][width])
+static int close_output(FILE * out_file)
+{
+    /* Buffered data is only known to have been written once it is flushed. */
+    if (errno = 0, out_file == stdout ? fflush(out_file) : fclose(out_file)) {
+        errno ? perror(out_file == stdout ? "fflush()" : "fclose()") :
+            (void) fputs("Error - failed to write to output file.\n", stderr);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_headers(const BITMAPFILEHEADER * restrict bf,
+                         const BITMAPINFOHEADER * restrict bi,
+                         FILE * restrict out_file)
 {
     if (out_file != stdout && !(errno = 0, freopen(NULL, "wb", out_file))) {
         errno ? perror("freopen()") :
@@ -64,6 +76,17 @@ int write_image(const BITMAPFILEHEADER * restrict bf,
         fputs("Error - failed to write to output file.\n", stderr);
         return -1;
     }
+    return 0;
+}
+
+int write_image(const BITMAPFILEHEADER * restrict bf,
+                const BITMAPINFOHEADER * restrict bi,
+                FILE * restrict out_file, size_t height,
+                size_t width, const RGBTRIPLE image[height][width])
+{
+    if (write_headers(bf, bi, out_file) == -1) {
+        return -1;
+    }
 
     const size_t padding = determine_padding(width);
 
@@ -71,7 +94,86 @@ int write_image(const BITMAPFILEHEADER * restrict bf,
         fputs("Error - failed to write to output file.\n", stderr);
         return -1;
     }
-    return out_file == stdout || !fclose(out_file);
+    return close_output(out_file);
+}
+
+static int write_indexed_scanlines(FILE * out_file, size_t height,
+                                   size_t width, unsigned bitcount,
+                                   const uint8_t indices[][width],
+                                   uint8_t row[], size_t row_size)
+{
+    /* Pixels narrower than a byte are packed most significant bits first. */
+    for (size_t i = 0; i < height; ++i) {
+        memset(row, 0x00, row_size);
+
+        for (size_t j = 0; j < width; ++j) {
+            const size_t bit = j * bitcount;
+
+            row[bit / CHAR_BIT] |= (uint8_t) (indices[i][j] <<
+                                              (CHAR_BIT - bitcount -
+                                               bit % CHAR_BIT));
+        }
+
+        if (fwrite(row, 1, row_size, out_file) != row_size) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int write_indexed_image(const BITMAPFILEHEADER * restrict bf,
+                        const BITMAPINFOHEADER * restrict bi,
+                        FILE * restrict out_file, size_t height,
+                        size_t width, unsigned bitcount, size_t ncolours,
+                        const RGBQUAD palette[restrict ncolours],
+                        const uint8_t indices[height][width])
+{
+    /* Each scanline, padding included, must be a multiple of
+     * BMP_SCANLINE_PADDING bytes in size.
+     */
+    const size_t row_size =
+        (width * bitcount + BMP_SCANLINE_PADDING * CHAR_BIT - 1) /
+        (BMP_SCANLINE_PADDING * CHAR_BIT) * BMP_SCANLINE_PADDING;
+    BITMAPFILEHEADER out_bf = *bf;
+    BITMAPINFOHEADER out_bi = *bi;
+
+    out_bi.bi_bitcount = (uint16_t) bitcount;
+    out_bi.bi_compression = 0;
+    out_bi.bi_size_image = (uint32_t) (row_size * height);
+    out_bi.bi_clr_used = (uint32_t) ncolours;
+    out_bi.bi_clr_important = 0;
+
+    /* The color table sits between the headers and the pixel data. */
+    out_bf.bf_offbits =
+        (uint32_t) (sizeof out_bf.bf_type + BF_UNPADDED_REGION_SIZE +
+                    sizeof out_bi + ncolours * sizeof *palette);
+    out_bf.bf_size = out_bf.bf_offbits + out_bi.bi_size_image;
+
+    uint8_t *const row = (errno = 0, malloc(row_size));
+
+    if (!row) {
+        errno ? perror("malloc()") :
+            (void) fputs("Error - failed to allocate memory for a scanline.\n",
+                         stderr);
+        return -1;
+    }
+
+    if (write_headers(&out_bf, &out_bi, out_file) == -1) {
+        free(row);
+        return -1;
+    }
+
+    if (fwrite(palette, sizeof *palette, ncolours, out_file) != ncolours
+        || write_indexed_scanlines(out_file, height, width, bitcount,
+                                   indices, row, row_size) == -1) {
+        fputs("Error - failed to write to output file.\n", stderr);
+        free(row);
+        return -1;
+    }
+
+    free(row);
+    return close_output(out_file);
 }
 
 static int read_scanlines(FILE * in_file, size_t height, size_t width,
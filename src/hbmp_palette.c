@@ -0,0 +1,336 @@
+#include "hbmp.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Colors are binned into a HIST_BITS per channel histogram, both for building
+ * the palette and for the nearest-color lookup table.
+ */
+#define HIST_BITS           5
+#define HIST_LEVELS         (1u << HIST_BITS)
+#define HIST_SIZE           (HIST_LEVELS * HIST_LEVELS * HIST_LEVELS)
+#define HIST_INDEX(r, g, b) \
+        (((size_t) (r) << (2 * HIST_BITS)) | ((size_t) (g) << HIST_BITS) | (size_t) (b))
+#define TO_CELL(x)          (((unsigned) (x) * (HIST_LEVELS - 1) + 127u) / 255u)
+
+#define UNMAPPED            UINT16_MAX
+
+#define DITHER_SIZE         4
+#define DITHER_LEVELS       (DITHER_SIZE * DITHER_SIZE)
+
+#define MIN(x, y)   ((x) < (y) ? (x) : (y))
+#define MAX(x, y)   ((x) > (y) ? (x) : (y))
+
+/* Bayer threshold map for ordered dithering. */
+static const int bayer[DITHER_SIZE][DITHER_SIZE] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+/* Pixel counts per cell, along with the sums of the red, green and blue values
+ * of those pixels, so that the palette holds the colors actually present
+ * rather than those of cell centers. The sums are 64-bit, as a 32-bit size_t
+ * would wrap for a cell of more than about 16.8M pixels.
+ */
+struct histogram {
+    size_t count[HIST_SIZE];
+    uint_least64_t sum[HIST_SIZE][3];
+};
+
+/* A box of histogram cells; bounds are inclusive and in red, green, blue order. */
+struct box {
+    unsigned lo[3];
+    unsigned hi[3];
+    size_t count;               /* Number of pixels within the box. */
+};
+
+static inline uint8_t clamp(int x)
+{
+    return (uint8_t) (x < 0 ? 0 : x > 255 ? 255 : x);
+}
+
+static inline int dither_offset(size_t i, size_t j, int spread)
+{
+    /* Center the threshold map on zero, so that dithering neither brightens
+     * nor darkens the image. The result lies within about half of spread.
+     */
+    return (2 * bayer[i % DITHER_SIZE][j % DITHER_SIZE] - (DITHER_LEVELS - 1))
+        * spread / (2 * DITHER_LEVELS);
+}
+
+size_t make_gray_palette(size_t ncolours, RGBQUAD palette[ncolours])
+{
+    for (size_t i = 0; i < ncolours; ++i) {
+        const uint8_t shade =
+            (uint8_t) ((i * 255 + (ncolours - 1) / 2) / (ncolours - 1));
+
+        palette[i] = (RGBQUAD) { shade, shade, shade, 0 };
+    }
+    return ncolours;
+}
+
+void map_gray(size_t height, size_t width,
+              const RGBTRIPLE image[height][width], size_t ncolours,
+              bool dither, uint8_t indices[height][width])
+{
+    /* The distance between two adjacent shades. */
+    const int spread = (int) (255 / (ncolours - 1));
+
+    for (size_t i = 0; i < height; ++i) {
+        for (size_t j = 0; j < width; ++j) {
+            const int offset = dither ? dither_offset(i, j, spread) : 0;
+            const size_t shade =
+                clamp(image[i][j].rgbt_green + offset);
+
+            indices[i][j] =
+                (uint8_t) ((shade * (ncolours - 1) + 127) / 255);
+        }
+    }
+}
+
+static void shrink_box(const struct histogram *restrict hist,
+                       struct box *restrict box)
+{
+    unsigned lo[3] = { HIST_LEVELS - 1, HIST_LEVELS - 1, HIST_LEVELS - 1 };
+    unsigned hi[3] = { 0, 0, 0 };
+    unsigned c[3];
+
+    box->count = 0;
+
+    for (c[0] = box->lo[0]; c[0] <= box->hi[0]; ++c[0]) {
+        for (c[1] = box->lo[1]; c[1] <= box->hi[1]; ++c[1]) {
+            for (c[2] = box->lo[2]; c[2] <= box->hi[2]; ++c[2]) {
+                const size_t n = hist->count[HIST_INDEX(c[0], c[1], c[2])];
+
+                if (n) {
+                    for (size_t k = 0; k < 3; ++k) {
+                        lo[k] = MIN(lo[k], c[k]);
+                        hi[k] = MAX(hi[k], c[k]);
+                    }
+                    box->count += n;
+                }
+            }
+        }
+    }
+
+    for (size_t k = 0; k < 3; ++k) {
+        box->lo[k] = lo[k];
+        box->hi[k] = hi[k];
+    }
+}
+
+static size_t longest_axis(const struct box *box)
+{
+    size_t axis = 0;
+
+    for (size_t k = 1; k < 3; ++k) {
+        if (box->hi[k] - box->lo[k] > box->hi[axis] - box->lo[axis]) {
+            axis = k;
+        }
+    }
+    return axis;
+}
+
+static void split_box(const struct histogram *restrict hist,
+                      struct box *restrict box, struct box *restrict other)
+{
+    const size_t axis = longest_axis(box);
+    size_t plane[HIST_LEVELS] = { 0 };
+    unsigned c[3];
+
+    for (c[0] = box->lo[0]; c[0] <= box->hi[0]; ++c[0]) {
+        for (c[1] = box->lo[1]; c[1] <= box->hi[1]; ++c[1]) {
+            for (c[2] = box->lo[2]; c[2] <= box->hi[2]; ++c[2]) {
+                plane[c[axis]] += hist->count[HIST_INDEX(c[0], c[1], c[2])];
+            }
+        }
+    }
+
+    /* Both end planes of a shrunk box are non-empty, so cutting anywhere
+     * before the last plane leaves pixels on either side.
+     */
+    unsigned cut = box->lo[axis];
+    size_t below = plane[cut];
+
+    while (cut + 1 < box->hi[axis] && 2 * below < box->count) {
+        below += plane[++cut];
+    }
+
+    *other = *box;
+    box->hi[axis] = cut;
+    other->lo[axis] = cut + 1;
+    shrink_box(hist, box);
+    shrink_box(hist, other);
+}
+
+static RGBQUAD box_mean(const struct histogram *restrict hist,
+                        const struct box *restrict box)
+{
+    uint_least64_t sum[3] = { 0, 0, 0 };
+    unsigned c[3];
+
+    for (c[0] = box->lo[0]; c[0] <= box->hi[0]; ++c[0]) {
+        for (c[1] = box->lo[1]; c[1] <= box->hi[1]; ++c[1]) {
+            for (c[2] = box->lo[2]; c[2] <= box->hi[2]; ++c[2]) {
+                const size_t cell = HIST_INDEX(c[0], c[1], c[2]);
+
+                for (size_t k = 0; k < 3; ++k) {
+                    sum[k] += hist->sum[cell][k];
+                }
+            }
+        }
+    }
+
+    return (RGBQUAD) {
+        .rgb_red = (uint8_t) ((sum[0] + box->count / 2) / box->count),
+        .rgb_green = (uint8_t) ((sum[1] + box->count / 2) / box->count),
+        .rgb_blue = (uint8_t) ((sum[2] + box->count / 2) / box->count),
+        .rgb_reserved = 0,
+    };
+}
+
+size_t make_palette(size_t height, size_t width,
+                    const RGBTRIPLE image[height][width], size_t max_colours,
+                    RGBQUAD palette[max_colours])
+{
+    struct histogram *const hist = (errno = 0, calloc(1, sizeof *hist));
+
+    if (!hist) {
+        errno ? perror("calloc()") : (void)
+            fputs("Error - failed to allocate memory for the histogram.\n",
+                  stderr);
+        return 0;
+    }
+
+    for (size_t i = 0; i < height; ++i) {
+        for (size_t j = 0; j < width; ++j) {
+            const size_t cell = HIST_INDEX(TO_CELL(image[i][j].rgbt_red),
+                                           TO_CELL(image[i][j].rgbt_green),
+                                           TO_CELL(image[i][j].rgbt_blue));
+
+            ++hist->count[cell];
+            hist->sum[cell][0] += image[i][j].rgbt_red;
+            hist->sum[cell][1] += image[i][j].rgbt_green;
+            hist->sum[cell][2] += image[i][j].rgbt_blue;
+        }
+    }
+
+    struct box boxes[BMP_MAX_PALETTE_SIZE] = {
+        { { 0, 0, 0 },
+          { HIST_LEVELS - 1, HIST_LEVELS - 1, HIST_LEVELS - 1 }, 0 },
+    };
+    size_t nboxes = 1;
+
+    shrink_box(hist, &boxes[0]);
+    max_colours = MIN(max_colours, BMP_MAX_PALETTE_SIZE);
+
+    while (nboxes < max_colours) {
+        /* Split the box that covers the most pixels over the widest range;
+         * boxes of a single cell cannot be split at all.
+         */
+        size_t best = 0;
+        uint_least64_t best_score = 0;
+
+        for (size_t k = 0; k < nboxes; ++k) {
+            const size_t axis = longest_axis(&boxes[k]);
+            const uint_least64_t score = (uint_least64_t) boxes[k].count *
+                (boxes[k].hi[axis] - boxes[k].lo[axis]);
+
+            if (score > best_score) {
+                best = k;
+                best_score = score;
+            }
+        }
+
+        if (!best_score) {
+            break;
+        }
+        split_box(hist, &boxes[best], &boxes[nboxes++]);
+    }
+
+    for (size_t k = 0; k < nboxes; ++k) {
+        palette[k] = box_mean(hist, &boxes[k]);
+    }
+
+    free(hist);
+    return nboxes;
+}
+
+static uint16_t nearest(size_t ncolours, const RGBQUAD palette[ncolours],
+                        int red, int green, int blue)
+{
+    size_t best = 0;
+    int best_dist = 3 * 256 * 256;
+
+    for (size_t k = 0; k < ncolours; ++k) {
+        const int dr = red - palette[k].rgb_red;
+        const int dg = green - palette[k].rgb_green;
+        const int db = blue - palette[k].rgb_blue;
+        const int dist = dr * dr + dg * dg + db * db;
+
+        if (dist < best_dist) {
+            best = k;
+            best_dist = dist;
+        }
+    }
+    return (uint16_t) best;
+}
+
+void map_palette(size_t height, size_t width,
+                 const RGBTRIPLE image[height][width], size_t ncolours,
+                 const RGBQUAD palette[ncolours], bool dither,
+                 uint8_t indices[height][width])
+{
+    /* The nearest entry of each cell is searched for once, on first use, with
+     * the color of the pixel that hit it. As every color of the image was
+     * counted in a box whose mean is that color if it is alone in its cell,
+     * an image with no more colors than the palette maps onto it exactly.
+     */
+    uint16_t lookup[HIST_SIZE];
+
+    memset(lookup, 0xFF, sizeof lookup);
+
+    /* A heuristic, not the spacing of any real palette: with levels the
+     * largest number of shades per channel a uniform palette of ncolours
+     * entries could hold, use 255 / (levels + 1). That is narrower than the
+     * 255 / (levels - 1) between neighbors of such a palette (36 rather than
+     * 51 for 256 colors, 85 rather than 255 for 16), as an adaptive palette
+     * places its entries closer together where the image's colors are.
+     */
+    int levels = 1;
+
+    while ((size_t) ((levels + 1) * (levels + 1) * (levels + 1)) <= ncolours) {
+        ++levels;
+    }
+
+    const int spread = 255 / (levels + 1);
+
+    for (size_t i = 0; i < height; ++i) {
+        for (size_t j = 0; j < width; ++j) {
+            const int offset = dither ? dither_offset(i, j, spread) : 0;
+            const uint8_t red = clamp(image[i][j].rgbt_red + offset);
+            const uint8_t green = clamp(image[i][j].rgbt_green + offset);
+            const uint8_t blue = clamp(image[i][j].rgbt_blue + offset);
+            const size_t cell =
+                HIST_INDEX(TO_CELL(red), TO_CELL(green), TO_CELL(blue));
+
+            if (lookup[cell] == UNMAPPED) {
+                lookup[cell] = nearest(ncolours, palette, red, green, blue);
+            }
+            indices[i][j] = (uint8_t) lookup[cell];
+        }
+    }
+}
+
+#undef HIST_BITS
+#undef HIST_LEVELS
+#undef HIST_SIZE
+#undef HIST_INDEX
+#undef TO_CELL
+#undef UNMAPPED
+#undef DITHER_SIZE
+#undef DITHER_LEVELS
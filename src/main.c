@@ -9,27 +9,77 @@
 #define _POSIX_C_SOURCE 200819L
 #define _XOPEN_SOURCE   700
 
-#include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "hbmp.h"
 
-/* ARRAY_CARDINALITY(x) calculates the number of elements in the array 'x'.
- * If 'x' is a pointer, it will trigger an assertion.
- */
-#define ARRAY_CARDINALITY(x) \
-        (assert((void *)&(x) == (void *)(x)), sizeof (x) / sizeof *(x))
+struct output {
+    FILE *file;                 /* Output stream. */
+    const char *chain;          /* Filters to apply, by name; NULL for the flags. */
+    struct output *next;        /* Next output of the same chain. */
+};
 
 struct flags {
     bool sflag;                 /* Sepia flag. */
     bool rflag;                 /* Reverse flag. */
     bool gflag;                 /* Greyscale flag. */
     bool bflag;                 /* Blur flag. */
-    FILE *out_file;             /* Output to file. */
+    bool dflag;                 /* Dither flag. */
+    unsigned palette_bits;      /* Bits per pixel of indexed output; 0 for none. */
+    struct output *outputs;     /* Outputs to write. */
+    size_t noutputs;            /* Number of outputs. */
+};
+
+/* Filters in the order the flags apply them. A chain names filters by the
+ * character of their short option.
+ */
+static const struct {
+    char name;
+    void (*const func)(size_t height, size_t width,
+                       RGBTRIPLE image[height][width]);
+} filters[] = {
+    { 's', sepia },
+    { 'r', reflect },
+    { 'g', grayscale },
+    { 'b', blur },
+};
+
+#define FILTER_COUNT (sizeof filters / sizeof *filters)
+
+/* A node of the tree of chains. Each node is the image of its parent with
+ * one more filter applied, so chains sharing a prefix share its nodes.
+ */
+struct chain_node {
+    void (*func)(size_t height, size_t width,
+                 RGBTRIPLE image[height][width]);       /* NULL at the root. */
+    struct chain_node *children[FILTER_COUNT];
+    struct output *outputs;     /* Outputs of the chain ending here. */
+};
+
+/* What every node of the tree needs to process and write its image. */
+struct job {
+    const struct flags *options;
+    const BITMAPFILEHEADER *bf;
+    const BITMAPINFOHEADER *bi;
+    size_t height;
+    size_t width;
+};
+
+struct branch {
+    const struct job *job;
+    const struct chain_node *node;
+    void *image;                /* Owned by the branch. */
+    int result;
+    bool joinable;              /* Whether it runs on a thread of its own. */
+    pthread_t thread;
 };
 
 static inline bool is_little_endian(void)
@@ -48,7 +98,14 @@ static void help(void)
          "    -r, --reverse         Create a horizontal reflection for a mirror effect.\n"
          "    -g, --grayscale       Convert the image to classic greyscale.\n"
          "    -b, --blur            Add a soft blur to the image.\n"
-         "    -o, --output=FILE     Writes the output to the specified file.\n"
+         "    -p, --palette=BITS    Write an indexed image with 1, 4 or 8 bits per pixel.\n"
+         "    -d, --dither          Apply ordered dithering to indexed output; requires -p.\n"
+         "    -o, --output=FILE[:CHAIN]\n"
+         "                          Writes the output to the specified file. CHAIN\n"
+         "                          names the filters to apply, in order, e.g. gb\n"
+         "                          for grayscale then blur; without it, the flags\n"
+         "                          above are used. May be repeated to write several\n"
+         "                          outputs from a single read of the input.\n"
          "    -h, --help            displays this message and exit.\n");
     exit(EXIT_SUCCESS);
 }
@@ -60,6 +117,125 @@ static void err_and_exit(void)
     exit(EXIT_FAILURE);
 }
 
+static unsigned parse_palette_bits(const char *arg)
+{
+    char *end;
+    const unsigned long bits = (errno = 0, strtoul(arg, &end, 10));
+
+    if (errno || end == arg || *end || (bits != 1 && bits != 4 && bits != 8)) {
+        fputs("Error - palette depth must be 1, 4 or 8.\n", stderr);
+        err_and_exit();
+    }
+    return (unsigned) bits;
+}
+
+static size_t filter_index(char name)
+{
+    size_t i = 0;
+
+    while (i < FILTER_COUNT && filters[i].name != name) {
+        ++i;
+    }
+    return i;
+}
+
+static bool is_chain(const char *chain)
+{
+    for (; *chain; ++chain) {
+        if (filter_index(*chain) == FILTER_COUNT) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_word(const char *str)
+{
+    if (!*str) {
+        return false;
+    }
+
+    for (; *str; ++str) {
+        if (!isalpha((unsigned char) *str)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_same_file(FILE *lhs, FILE *rhs)
+{
+    struct stat lhs_stat;
+    struct stat rhs_stat;
+
+    return !fstat(fileno(lhs), &lhs_stat) && !fstat(fileno(rhs), &rhs_stat)
+        && lhs_stat.st_dev == rhs_stat.st_dev
+        && lhs_stat.st_ino == rhs_stat.st_ino;
+}
+
+static void add_output(struct flags *restrict opt_ptr, char *arg)
+{
+    /* Only split off what follows the last colon if it is a valid chain, so
+     * that other file names containing colons still work.
+     */
+    char *const colon = strrchr(arg, ':');
+    const char *chain = NULL;
+
+    if (colon && is_chain(colon + 1)) {
+        *colon = '\0';
+        chain = colon + 1;
+    } else if (colon && is_word(colon + 1)) {
+        /* Most likely a mistyped chain rather than part of the file name. */
+        for (const char *name = colon + 1; *name; ++name) {
+            if (filter_index(*name) == FILTER_COUNT) {
+                fprintf(stderr,
+                        "Warning - unknown filter '%c' in '%s'; writing to %s "
+                        "with the filters selected by the flags.\n",
+                        *name, colon + 1, arg);
+                break;
+            }
+        }
+    }
+
+    struct output *const outputs = (errno = 0,
+                                    realloc(opt_ptr->outputs,
+                                            (opt_ptr->noutputs +
+                                             1) * sizeof *outputs));
+
+    if (!outputs) {
+        errno ? perror("realloc()") : (void)
+            fputs("Error - failed to allocate memory for the outputs.\n",
+                  stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    /* We'll seek to the beginning once we've read input,
+     * in case it's the same file. 
+     */
+    FILE *const file = (errno = 0, fopen(arg, "ab"));
+
+    if (!file) {
+        errno ? perror(arg) : (void)
+            fputs("Error - failed to open output file.\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Outputs may be written concurrently, so two of them must never be
+     * the same file, however it is named.
+     */
+    for (size_t i = 0; i < opt_ptr->noutputs; ++i) {
+        if (is_same_file(outputs[i].file, file)) {
+            fprintf(stderr,
+                    "Error - %s is given as an output more than once.\n",
+                    arg);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    outputs[opt_ptr->noutputs++] = (struct output) { file, chain, NULL };
+    opt_ptr->outputs = outputs;
+}
+
 static void parse_options(const struct option *restrict long_options,
                           const char *restrict short_options,
                           struct flags *restrict opt_ptr, int argc,
@@ -82,19 +258,17 @@ static void parse_options(const struct option *restrict long_options,
             case 'b':
                 opt_ptr->bflag = true;
                 break;
+            case 'd':
+                opt_ptr->dflag = true;
+                break;
+            case 'p':
+                opt_ptr->palette_bits = parse_palette_bits(optarg);
+                break;
             case 'h':
                 help();
                 break;
             case 'o':
-                /* We'll seek to the beginning once we've read input,
-                 * in case it's the same file. 
-                 */
-                opt_ptr->out_file = (errno = 0, fopen(optarg, "ab"));
-
-                if (!opt_ptr->out_file) {
-                    errno ? perror(optarg) : (void)
-                        fputs("Error - failed to open output file.", stderr);
-                }
+                add_output(opt_ptr, optarg);
                 break;
 
                 /* case '?' */
@@ -105,29 +279,185 @@ static void parse_options(const struct option *restrict long_options,
     }
 }
 
-static void apply_filter(const struct flags *options, size_t height,
-                         size_t width, RGBTRIPLE image[height][width])
+static int write_palettized_image(const struct flags *restrict options,
+                                  const BITMAPFILEHEADER * restrict bf,
+                                  const BITMAPINFOHEADER * restrict bi,
+                                  FILE * restrict out_file, size_t height,
+                                  size_t width, void *image)
 {
-    struct {
-        bool flag;
-        void (*const func)(size_t height, size_t width,
-                           RGBTRIPLE image[height][width]);
-    } group[] = {
-        { options->sflag, sepia },
-        { options->rflag, reflect },
-        { options->gflag, grayscale },
-        { options->bflag, blur },
-    };
+    RGBQUAD palette[BMP_MAX_PALETTE_SIZE];
+    const size_t max_colours = (size_t) 1 << options->palette_bits;
+    size_t ncolours;
+    void *const indices = (errno = 0, calloc(height, width));
+
+    if (!indices) {
+        errno ? perror("calloc()") : (void)
+            fputs("Error - not enough memory to store image.\n", stderr);
+        return -1;
+    }
+
+    /* Grayscale images map straight onto a ramp of grays, with no search. */
+    if (is_grayscale(height, width, image)) {
+        ncolours = make_gray_palette(max_colours, palette);
+        map_gray(height, width, image, ncolours, options->dflag, indices);
+    } else {
+        ncolours = make_palette(height, width, image, max_colours, palette);
+
+        if (!ncolours) {
+            free(indices);
+            return -1;
+        }
+        map_palette(height, width, image, ncolours, palette, options->dflag,
+                    indices);
+    }
 
-    for (size_t i = 0; i < ARRAY_CARDINALITY(group); ++i) {
-        if (group[i].flag) {
-            group[i].func(height, width, image);
+    const int result = write_indexed_image(bf, bi, out_file, height, width,
+                                           options->palette_bits, ncolours,
+                                           palette, indices);
+
+    free(indices);
+    return result;
+}
+
+static int write_output(const struct job *job, FILE * out_file,
+                        void *image)
+{
+    return job->options->palette_bits
+        ? write_palettized_image(job->options, job->bf, job->bi, out_file,
+                                 job->height, job->width, image)
+        : write_image(job->bf, job->bi, out_file, job->height, job->width,
+                      image);
+}
+
+static int run_node(const struct job *job, const struct chain_node *node,
+                    void *image);
+
+static void *run_branch(void *arg)
+{
+    struct branch *const branch = arg;
+
+    branch->result = run_node(branch->job, branch->node, branch->image);
+    return NULL;
+}
+
+/* Applies the node's filter to the image, writes the node's outputs, then
+ * runs the branches below it concurrently. Takes ownership of the image.
+ */
+static int run_node(const struct job *job, const struct chain_node *node,
+                    void *image)
+{
+    const size_t size = job->height * job->width * sizeof (RGBTRIPLE);
+    struct branch branches[FILTER_COUNT];
+    size_t nbranches = 0;
+    int result = 0;
+
+    if (node->func) {
+        node->func(job->height, job->width, image);
+    }
+
+    for (const struct output *out = node->outputs; out; out = out->next) {
+        if (write_output(job, out->file, image) == -1) {
+            result = -1;
         }
     }
+
+    for (size_t i = 0; i < FILTER_COUNT; ++i) {
+        if (node->children[i]) {
+            branches[nbranches++] = (struct branch) {
+                .job = job,
+                .node = node->children[i],
+            };
+        }
+    }
+
+    if (!nbranches) {
+        free(image);
+        return result;
+    }
+
+    /* Every branch but the last works on a copy of the image, which the last
+     * branch then takes over, so an image with a single consumer is never
+     * copied.
+     */
+    for (size_t i = 0; i + 1 < nbranches; ++i) {
+        branches[i].image = (errno = 0, malloc(size));
+
+        if (!branches[i].image) {
+            errno ? perror("malloc()") : (void)
+                fputs("Error - not enough memory to store image.\n", stderr);
+            branches[i].result = -1;
+            continue;
+        }
+
+        memcpy(branches[i].image, image, size);
+        branches[i].joinable =
+            !pthread_create(&branches[i].thread, NULL, run_branch,
+                            &branches[i]);
+
+        if (!branches[i].joinable) {
+            run_branch(&branches[i]);
+        }
+    }
+
+    branches[nbranches - 1].image = image;
+    run_branch(&branches[nbranches - 1]);
+
+    for (size_t i = 0; i < nbranches; ++i) {
+        if (branches[i].joinable) {
+            pthread_join(branches[i].thread, NULL);
+        }
+        if (branches[i].result == -1) {
+            result = -1;
+        }
+    }
+
+    return result;
 }
 
-static int process_image(const struct flags *restrict options,
-                         FILE * restrict in_file, FILE * restrict out_file)
+static void free_tree(struct chain_node *node)
+{
+    for (size_t i = 0; i < FILTER_COUNT; ++i) {
+        if (node->children[i]) {
+            free_tree(node->children[i]);
+            free(node->children[i]);
+        }
+    }
+}
+
+static int build_tree(struct chain_node *restrict root,
+                      struct flags *restrict options,
+                      const char *restrict flags_chain)
+{
+    for (size_t i = 0; i < options->noutputs; ++i) {
+        struct output *const out = &options->outputs[i];
+        struct chain_node *node = root;
+
+        for (const char *name = out->chain ? out->chain : flags_chain; *name;
+             ++name) {
+            const size_t k = filter_index(*name);
+
+            if (!node->children[k]) {
+                node->children[k] = (errno = 0, calloc(1, sizeof *node));
+
+                if (!node->children[k]) {
+                    errno ? perror("calloc()") : (void)
+                        fputs("Error - failed to allocate memory for a chain.\n",
+                              stderr);
+                    return -1;
+                }
+                node->children[k]->func = filters[k].func;
+            }
+            node = node->children[k];
+        }
+
+        out->next = node->outputs;
+        node->outputs = out;
+    }
+    return 0;
+}
+
+static int process_image(struct flags *restrict options,
+                         FILE * restrict in_file)
 {
     BITMAPFILEHEADER bf;
     BITMAPINFOHEADER bi;
@@ -135,20 +465,39 @@ static int process_image(const struct flags *restrict options,
     size_t height = 0;
     size_t width = 0;
 
-    void *const image = read_image(&bf, &bi, &height, &width, in_file);
+    /* Outputs without a chain of their own apply the filters selected by the
+     * flags.
+     */
+    const bool flag_set[FILTER_COUNT] = {
+        options->sflag, options->rflag, options->gflag, options->bflag
+    };
+    char flags_chain[FILTER_COUNT + 1] = { 0 };
 
-    if (!image) {
+    for (size_t i = 0, len = 0; i < FILTER_COUNT; ++i) {
+        if (flag_set[i]) {
+            flags_chain[len++] = filters[i].name;
+        }
+    }
+
+    struct chain_node root = { 0 };
+
+    if (build_tree(&root, options, flags_chain) == -1) {
+        free_tree(&root);
         return -1;
     }
 
-    apply_filter(options, height, width, image);
+    void *const image = read_image(&bf, &bi, &height, &width, in_file);
 
-    if (write_image(&bf, &bi, out_file, height, width, image) == -1) {
+    if (!image) {
+        free_tree(&root);
         return -1;
     }
 
-    free(image);
-    return 0;
+    const struct job job = { options, &bf, &bi, height, width };
+    const int result = run_node(&job, &root, image);
+
+    free_tree(&root);
+    return result;
 }
 
 int main(int argc, char *argv[])
@@ -173,16 +522,29 @@ int main(int argc, char *argv[])
         { "reverse", no_argument, NULL, 'r' },
         { "sepia", no_argument, NULL, 's' },
         { "blur", no_argument, NULL, 'b' },
+        { "dither", no_argument, NULL, 'd' },
+        { "palette", required_argument, NULL, 'p' },
         { "help", no_argument, NULL, 'h' },
         { "output", required_argument, NULL, 'o' },
         { NULL, 0, NULL, 0 }
     };
 
     FILE *in_file = stdin;
-    struct flags options = { false, false, false, false, stdout };
+    struct flags options = { false, false, false, false, false, 0, NULL, 0 };
+    struct output default_output = { stdout, NULL, NULL };
     int result = EXIT_SUCCESS;
 
-    parse_options(long_options, "grsbho:", &options, argc, argv);
+    parse_options(long_options, "grsbdhp:o:", &options, argc, argv);
+
+    if (options.dflag && !options.palette_bits) {
+        fputs("Error - dithering requires an indexed output (-p).\n", stderr);
+        err_and_exit();
+    }
+
+    if (!options.noutputs) {
+        options.outputs = &default_output;
+        options.noutputs = 1;
+    }
 
     if ((optind + 1) == argc) {
         in_file = (errno = 0, fopen(argv[optind], "rb"));
@@ -196,10 +558,14 @@ int main(int argc, char *argv[])
         err_and_exit();
     }
 
-    if (process_image(&options, in_file, options.out_file) == -1) {
+    if (process_image(&options, in_file) == -1) {
         result = EXIT_FAILURE;
     }
 
+    if (options.outputs != &default_output) {
+        free(options.outputs);
+    }
+
     if (in_file != stdin) {
         fclose(in_file);
     }